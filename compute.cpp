@@ -1,3 +1,4 @@
+#include "jacshard.hpp"
 #include "jactest.hpp"
 #include "plottest.hpp"
 // I like to keep my main relatively empty so I can see what is going on
@@ -18,6 +19,16 @@ int main(void) {
 #define OMP_NUM_THREAS = 4;  // This test is poorly optimized, 4 is maximal gain
   // Expected behavior: "Jacobian Test 2 Completed: N N" printed to terminal
   runJacTest2(sizeTest2);
+  // Same test split over worker processes, one per cpu by default, each pinned
+  // to its cpu's NUMA node
+  // Expected behavior: "Jacobian Shard Test Completed with size: N N on P procs"
+  // printed to terminal
+  // runJacTest2Sharded(sizeTest2, 0);
+  // Same test again, but keeping the whole jacobian. Give the container a file
+  // name to have it mmap'd from disk instead of allocated (the file must not
+  // exist yet, we won't overwrite an earlier result)
+  // adoopp::BlockedJac jac(sizeTest2, sizeTest2, "jac.bin");
+  // runJacTest2InPlace(jac);
   std::string outputFile1 = "file1.out";
   // Expected bavior: tsv of x*sin(y) and surface tangent to (sin(y) +x(cos*y))
   // Plot with python3 plot.py (need numpy and matplotlib)
@@ -0,0 +1,442 @@
+#ifndef INCLUDED_ADOOPP_JACMATRIX
+#define INCLUDED_ADOOPP_JACMATRIX
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+/*
+Containers to hold a whole jacobian instead of printing pieces of it
+
+Jac(i, j) = df_i/dx_j, rows are functions and columns are variables.
+->DenseJac: plain column major, a column (one seed) is contiguous
+->BlockedJac: the matrix is cut in square tiles stored one after another, so
+  filling a tile only touches a tile's worth of cache
+->CsrJac: compressed rows for a known sparsity pattern, only the pattern is
+  stored
+
+Every container keeps its values in a JacBuffer. By default that is anonymous
+memory, but given a file path the values are mmap'd from that file instead.
+Then the kernel pages the matrix in and out for us and a jacobian bigger than
+RAM streams to disk rather than failing the allocation.
+
+The containers do the filling themselves, in the order that suits their
+layout, split over omp threads:
+->fillColumns(g) is the one forward mode wants: one seed gives a whole
+  column, so g(j, col) writes column j into col
+->fill(f) calls f(i, j) per stored entry, for entries that are cheap on their
+  own
+*/
+
+namespace adoopp {
+
+class JacBuffer {
+ public:
+  JacBuffer() = default;
+  // Anonymous memory when path is empty, the file at path otherwise. The file
+  // is created and must not exist yet, so an earlier result never gets
+  // clobbered by a rerun.
+  explicit JacBuffer(size_t n, const std::string& path = "") : size_(n) {
+    if (path.empty()) {
+      map(-1, MAP_PRIVATE | MAP_ANONYMOUS, "mmap");
+      return;
+    }
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd_ < 0)
+      fail("open " + path);
+    // A fresh ftruncate'd file reads back as zeros and takes no disk until
+    // written to
+    if (ftruncate(fd_, static_cast<off_t>(n * sizeof(double))) != 0)
+      fail("ftruncate " + path);
+    map(fd_, MAP_SHARED, "mmap " + path);
+  }
+
+  // POSIX shared memory instead of private, so the pages stay shared with
+  // processes we fork after this. The name is unlinked straight away so
+  // nothing is left in /dev/shm if we crash.
+  static JacBuffer shared(size_t n) {
+    static std::atomic<int> count(0);
+    const std::string name = "/adoopp_jac_" + std::to_string(getpid()) + "_" +
+                             std::to_string(count++);
+    JacBuffer buf;
+    buf.size_ = n;
+    buf.shared_ = true;
+    const int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      buf.fail("shm_open " + name);
+    shm_unlink(name.c_str());
+    if (ftruncate(fd, static_cast<off_t>(n * sizeof(double))) != 0) {
+      close(fd);
+      buf.fail("ftruncate " + name);
+    }
+    buf.map(fd, MAP_SHARED, "mmap " + name);
+    close(fd);
+    return buf;
+  }
+
+  JacBuffer(const JacBuffer&) = delete;
+  JacBuffer& operator=(const JacBuffer&) = delete;
+  JacBuffer(JacBuffer&& t) noexcept { swap(t); }
+  JacBuffer& operator=(JacBuffer&& t) noexcept {
+    swap(t);
+    return *this;
+  }
+  ~JacBuffer() {
+    if (data_)
+      munmap(data_, size_ * sizeof(double));
+    if (fd_ >= 0)
+      close(fd_);
+  }
+
+  double* data() { return data_; }
+  const double* data() const { return data_; }
+  size_t size() const { return size_; }
+  bool mapped() const { return fd_ >= 0; }
+  // Whether a forked child writes into the same pages we read
+  bool shareable() const { return shared_ || mapped(); }
+
+  // Push dirty pages to the file; no-op without one
+  void flush() {
+    if (mapped() && data_ &&
+        msync(data_, size_ * sizeof(double), MS_SYNC) != 0)
+      throw std::runtime_error(message("msync"));
+  }
+
+ private:
+  // Nothing is touched here: the pages are faulted in by whoever writes them
+  // first, so an omp (or forked) fill places them on the writer's node
+  void map(int fd, int flags, const std::string& what) {
+    if (size_ == 0)
+      return;
+    void* p = mmap(nullptr, size_ * sizeof(double), PROT_READ | PROT_WRITE,
+                   flags, fd, 0);
+    if (p == MAP_FAILED)
+      fail(what);
+    data_ = static_cast<double*>(p);
+  }
+  void swap(JacBuffer& t) {
+    std::swap(data_, t.data_);
+    std::swap(size_, t.size_);
+    std::swap(fd_, t.fd_);
+    std::swap(shared_, t.shared_);
+  }
+  static std::string message(const std::string& what) {
+    return "JacBuffer: " + what + ": " + std::strerror(errno);
+  }
+  void fail(const std::string& what) {
+    std::string msg = message(what);
+    if (fd_ >= 0)
+      close(fd_);
+    fd_ = -1;
+    throw std::runtime_error(msg);
+  }
+
+  double* data_ = nullptr;
+  size_t size_ = 0;
+  int fd_ = -1;
+  bool shared_ = false;
+};
+
+class DenseJac {
+ public:
+  // Columns are ld apart (rows if ld is 0); padding them lets callers line
+  // columns up with pages or cache lines
+  DenseJac(int rows, int cols, const std::string& path = "", int ld = 0)
+      : rows_(rows),
+        cols_(cols),
+        ld_(checkLd(rows, ld)),
+        buf_(static_cast<size_t>(ld_) * cols, path) {}
+  // Use a buffer made elsewhere, e.g. JacBuffer::shared for forked workers
+  DenseJac(int rows, int cols, JacBuffer buf, int ld = 0)
+      : rows_(rows), cols_(cols), ld_(checkLd(rows, ld)), buf_(std::move(buf)) {
+    if (buf_.size() < static_cast<size_t>(ld_) * cols)
+      throw std::invalid_argument("DenseJac: buffer too small");
+  }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int ld() const { return ld_; }
+  bool shareable() const { return buf_.shareable(); }
+  double* column(int j) { return buf_.data() + static_cast<size_t>(j) * ld_; }
+  double& operator()(int i, int j) { return buf_.data()[index(i, j)]; }
+  double operator()(int i, int j) const { return buf_.data()[index(i, j)]; }
+  void flush() { buf_.flush(); }
+
+  // Each thread gets its own copy of g, so it can keep scratch (the seeded
+  // duals) between columns. Columns are written straight into the matrix.
+  template <typename G>
+  void fillColumns(const G& g) {
+#pragma omp parallel
+    {
+      G local(g);
+#pragma omp for schedule(guided)
+      for (int j = 0; j < cols_; j++)
+        local(j, column(j));
+    }
+  }
+
+  // One column per iteration, walking down it
+  template <typename F>
+  void fill(F f) {
+    double* v = buf_.data();
+#pragma omp parallel for schedule(guided)
+    for (int j = 0; j < cols_; j++)
+      for (int i = 0; i < rows_; i++)
+        v[index(i, j)] = f(i, j);
+  }
+
+ private:
+  static int checkLd(int rows, int ld) {
+    if (ld == 0)
+      return rows;
+    if (ld < rows)
+      throw std::invalid_argument("DenseJac: ld smaller than rows");
+    return ld;
+  }
+  size_t index(int i, int j) const {
+    return static_cast<size_t>(j) * ld_ + i;
+  }
+  int rows_;
+  int cols_;
+  int ld_;
+  JacBuffer buf_;
+};
+
+class BlockedJac {
+ public:
+  // 64x64 doubles is 32K, one tile sits in L1/L2 while it is being filled
+  BlockedJac(int rows, int cols, const std::string& path = "", int tile = 64)
+      : rows_(rows),
+        cols_(cols),
+        tile_(checkTile(tile)),
+        tileRows_((rows + tile_ - 1) / tile_),
+        tileCols_((cols + tile_ - 1) / tile_),
+        buf_(static_cast<size_t>(tileRows_) * tileCols_ * tile_ * tile_,
+             path) {}
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  int tile() const { return tile_; }
+  double& operator()(int i, int j) { return buf_.data()[index(i, j)]; }
+  double operator()(int i, int j) const { return buf_.data()[index(i, j)]; }
+  void flush() { buf_.flush(); }
+
+  // One stripe of tile columns per iteration. A column is staged in scratch
+  // and scattered down its tiles, so a stripe stays with one thread.
+  template <typename G>
+  void fillColumns(const G& g) {
+    double* v = buf_.data();
+#pragma omp parallel
+    {
+      G local(g);
+      std::vector<double> col(rows_);
+#pragma omp for schedule(guided)
+      for (int tj = 0; tj < tileCols_; tj++) {
+        const int j1 = (tj + 1) * tile_ < cols_ ? (tj + 1) * tile_ : cols_;
+        for (int j = tj * tile_; j < j1; j++) {
+          local(j, col.data());
+          for (int i0 = 0; i0 < rows_; i0 += tile_) {
+            const int n = i0 + tile_ < rows_ ? tile_ : rows_ - i0;
+            std::memcpy(v + index(i0, j), col.data() + i0, n * sizeof(double));
+          }
+        }
+      }
+    }
+  }
+
+  // One tile per iteration, column major inside the tile
+  template <typename F>
+  void fill(F f) {
+    double* v = buf_.data();
+    const int ntiles = tileRows_ * tileCols_;
+#pragma omp parallel for schedule(guided)
+    for (int t = 0; t < ntiles; t++) {
+      const int i0 = (t % tileRows_) * tile_;
+      const int j0 = (t / tileRows_) * tile_;
+      const int i1 = i0 + tile_ < rows_ ? i0 + tile_ : rows_;
+      const int j1 = j0 + tile_ < cols_ ? j0 + tile_ : cols_;
+      for (int j = j0; j < j1; j++)
+        for (int i = i0; i < i1; i++)
+          v[index(i, j)] = f(i, j);
+    }
+  }
+
+ private:
+  static int checkTile(int tile) {
+    if (tile <= 0)
+      throw std::invalid_argument("BlockedJac: tile size must be positive");
+    return tile;
+  }
+  // Tiles are laid out column major, and so is each tile; edge tiles are
+  // padded to full size to keep the arithmetic simple
+  size_t index(int i, int j) const {
+    const size_t t =
+        static_cast<size_t>(j / tile_) * tileRows_ + static_cast<size_t>(i / tile_);
+    return t * tile_ * tile_ + static_cast<size_t>(j % tile_) * tile_ +
+           i % tile_;
+  }
+  int rows_;
+  int cols_;
+  int tile_;
+  int tileRows_;
+  int tileCols_;
+  JacBuffer buf_;
+};
+
+class CsrJac {
+ public:
+  // rowPtr has rows+1 offsets into colIdx, colIdx the strictly increasing
+  // columns of each row. Offsets are size_t so the pattern can go past 2^31
+  // nonzeros. Only the values go through the JacBuffer: the pattern stays in
+  // RAM, another 4 bytes per nonzero (half the values) plus the offsets.
+  CsrJac(int rows,
+         int cols,
+         std::vector<size_t> rowPtr,
+         std::vector<int> colIdx,
+         const std::string& path = "")
+      : rows_(rows),
+        cols_(cols),
+        rowPtr_(std::move(rowPtr)),
+        colIdx_(std::move(colIdx)),
+        buf_(checkPattern(rows, cols, rowPtr_, colIdx_), path) {}
+
+  // Build the pattern one row at a time: rowCols(i) returns the columns of
+  // row i, so only the nonzeros are ever visited
+  template <typename R>
+  static CsrJac fromRows(int rows,
+                         int cols,
+                         R rowCols,
+                         const std::string& path = "") {
+    std::vector<size_t> rowPtr(1, 0);
+    std::vector<int> colIdx;
+    rowPtr.reserve(static_cast<size_t>(rows) + 1);
+    for (int i = 0; i < rows; i++) {
+      const std::vector<int> row = rowCols(i);
+      colIdx.insert(colIdx.end(), row.begin(), row.end());
+      rowPtr.push_back(colIdx.size());
+    }
+    return CsrJac(rows, cols, std::move(rowPtr), std::move(colIdx), path);
+  }
+
+  int rows() const { return rows_; }
+  int cols() const { return cols_; }
+  size_t nnz() const { return colIdx_.size(); }
+  const std::vector<size_t>& rowPtr() const { return rowPtr_; }
+  const std::vector<int>& colIdx() const { return colIdx_; }
+  double* values() { return buf_.data(); }
+  const double* values() const { return buf_.data(); }
+  void flush() { buf_.flush(); }
+
+  // Entries outside the pattern are structural zeros
+  double operator()(int i, int j) const {
+    const size_t k = find(i, j);
+    return k == kAbsent ? 0 : buf_.data()[k];
+  }
+  bool contains(int i, int j) const { return find(i, j) != kAbsent; }
+
+  // A stripe of columns per iteration: compute them into scratch, then walk
+  // each row's part of the pattern inside the stripe and pick out the
+  // entries. Forward mode hands us whole columns whatever the pattern, so
+  // zero columns still get computed; the stripe is kept narrow enough that
+  // the scratch stays around kStageDoubles.
+  template <typename G>
+  void fillColumns(const G& g) {
+    double* v = buf_.data();
+    const int width = stripeWidth();
+    const int nstripes = (cols_ + width - 1) / width;
+#pragma omp parallel
+    {
+      G local(g);
+      std::vector<double> stage(static_cast<size_t>(rows_) * width);
+#pragma omp for schedule(guided)
+      for (int s = 0; s < nstripes; s++) {
+        const int j0 = s * width;
+        const int j1 = j0 + width < cols_ ? j0 + width : cols_;
+        for (int j = j0; j < j1; j++)
+          local(j, stage.data() + static_cast<size_t>(j - j0) * rows_);
+        for (int i = 0; i < rows_; i++) {
+          const int* first = colIdx_.data() + rowPtr_[i];
+          const int* last = colIdx_.data() + rowPtr_[i + 1];
+          for (const int* c = std::lower_bound(first, last, j0);
+               c != last && *c < j1; c++)
+            v[c - colIdx_.data()] =
+                stage[static_cast<size_t>(*c - j0) * rows_ + i];
+        }
+      }
+    }
+  }
+
+  // One row per iteration, only over the pattern
+  template <typename F>
+  void fill(F f) {
+    double* v = buf_.data();
+#pragma omp parallel for schedule(guided)
+    for (int i = 0; i < rows_; i++)
+      for (size_t k = rowPtr_[i]; k < rowPtr_[i + 1]; k++)
+        v[k] = f(i, colIdx_[k]);
+  }
+
+ private:
+  static const size_t kAbsent = static_cast<size_t>(-1);
+  // Scratch per thread for fillColumns, 8MB
+  static const size_t kStageDoubles = 1 << 20;
+  static const int kMaxStripe = 64;
+
+  int stripeWidth() const {
+    const size_t fit = rows_ > 0 ? kStageDoubles / rows_ : kMaxStripe;
+    if (fit < 1)
+      return 1;
+    return fit < static_cast<size_t>(kMaxStripe) ? static_cast<int>(fit)
+                                                  : kMaxStripe;
+  }
+
+  // find() binary searches each row, so a row out of order would silently
+  // read back as zeros; reject it up front. Returns nnz to size the values.
+  static size_t checkPattern(int rows,
+                             int cols,
+                             const std::vector<size_t>& rowPtr,
+                             const std::vector<int>& colIdx) {
+    if (rows < 0 || rowPtr.size() != static_cast<size_t>(rows) + 1 ||
+        rowPtr.front() != 0 || rowPtr.back() != colIdx.size())
+      throw std::invalid_argument("CsrJac: rowPtr does not match colIdx");
+    for (int i = 0; i < rows; i++) {
+      if (rowPtr[i] > rowPtr[i + 1])
+        throw std::invalid_argument("CsrJac: rowPtr is not monotonic");
+      for (size_t k = rowPtr[i]; k < rowPtr[i + 1]; k++) {
+        if (colIdx[k] < 0 || colIdx[k] >= cols)
+          throw std::invalid_argument("CsrJac: column index out of range");
+        if (k > rowPtr[i] && colIdx[k - 1] >= colIdx[k])
+          throw std::invalid_argument("CsrJac: row columns not sorted");
+      }
+    }
+    return colIdx.size();
+  }
+  size_t find(int i, int j) const {
+    size_t lo = rowPtr_[i], hi = rowPtr_[i + 1];
+    while (lo < hi) {
+      const size_t mid = lo + (hi - lo) / 2;
+      if (colIdx_[mid] < j)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    return lo < rowPtr_[i + 1] && colIdx_[lo] == j ? lo : kAbsent;
+  }
+  int rows_;
+  int cols_;
+  std::vector<size_t> rowPtr_;
+  std::vector<int> colIdx_;
+  JacBuffer buf_;
+};
+
+}  // namespace adoopp
+
+#endif
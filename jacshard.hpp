@@ -0,0 +1,422 @@
+#ifndef INCLUDED_JACSHARD
+#define INCLUDED_JACSHARD
+#include <sched.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <fstream>
+#include <new>
+#include <string>
+#include <vector>
+#include "dual.hpp"
+#include "jacmatrix.hpp"
+
+/*
+This is the multi-process version of runJacTest2
+
+The OpenMP version stops scaling well before we run out of cores on the big
+boxes. Threads end up reading points and allocating on whichever NUMA node they
+please, so most of the time goes to cross-node traffic instead of the AD.
+
+Instead we fork single-threaded worker processes, by default one per cpu, and
+pin each to the NUMA node that owns its cpu:
+->The jacobian is an adoopp::DenseJac over shared memory (JacBuffer::shared,
+  shm_open/mmap) or a file, so a column (one wrt) is one contiguous run
+->Workers claim chunks of columns from a small table in a second shared
+  segment and write their columns straight into the matrix. First touch is by the worker,
+  so the pages land on the worker's node
+->The parent is just a coordinator: if a worker dies, the chunks it had
+  claimed but not finished go back in the pool and a replacement is forked
+->Each worker allocates its variables once and only moves the seed between
+  columns, instead of new'ing an array every iteration
+
+Linux only (sysfs for the NUMA layout, sched_{get,set}affinity for pinning).
+*/
+
+namespace jacshard {
+
+// Chunk states in the shared table: free, done, or (slot + 1) while claimed
+const int kChunkFree = 0;
+const int kChunkDone = -1;
+// Columns per chunk; small enough to balance, big enough to amortize the claim
+const int kChunkCols = 16;
+// Give up on a slot after this many crashes, something is really wrong
+const int kMaxRestarts = 3;
+
+// Parse a sysfs cpulist ("0-3,8-11") into cpu ids
+inline std::vector<int> parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos)
+      end = list.size();
+    std::string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    if (!range.empty() && range[0] >= '0' && range[0] <= '9') {
+      int lo = std::stoi(range);
+      int hi = dash == std::string::npos ? lo : std::stoi(range.substr(dash + 1));
+      for (int c = lo; c <= hi; c++)
+        cpus.push_back(c);
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+// The cpus we may run on: taskset, cgroup cpusets and the like all show up
+// in our affinity mask, so that is what we carve up, not the whole host
+inline std::vector<int> allowedCpus() {
+  std::vector<int> cpus;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    const int count = CPU_COUNT(&set);
+    for (int c = 0; c < CPU_SETSIZE && static_cast<int>(cpus.size()) < count;
+         c++)
+      if (CPU_ISSET(c, &set))
+        cpus.push_back(c);
+  }
+  if (cpus.empty()) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    for (int c = 0; c < (online > 0 ? online : 1); c++)
+      cpus.push_back(c);
+  }
+  return cpus;
+}
+
+inline std::string readLine(const std::string& path) {
+  std::ifstream in(path);
+  std::string line;
+  if (in)
+    std::getline(in, line);
+  return line;
+}
+
+// One list of allowed cpus per NUMA node, nodes we can't run on dropped.
+// Node ids can have gaps (memoryless or offline nodes), so we take them from
+// has_cpu (or online) rather than counting up from node0. If sysfs has
+// nothing for us we pretend the machine is one node, which means no pinning.
+inline std::vector<std::vector<int>> numaNodes() {
+  const std::vector<int> allowed = allowedCpus();
+  const std::string base = "/sys/devices/system/node/";
+  std::string ids = readLine(base + "has_cpu");
+  if (ids.empty())
+    ids = readLine(base + "online");
+
+  std::vector<std::vector<int>> nodes;
+  for (int n : parseCpuList(ids)) {
+    std::vector<int> cpus;
+    for (int c :
+         parseCpuList(readLine(base + "node" + std::to_string(n) + "/cpulist")))
+      if (std::binary_search(allowed.begin(), allowed.end(), c))
+        cpus.push_back(c);
+    if (!cpus.empty())
+      nodes.push_back(cpus);
+  }
+  if (nodes.empty())
+    nodes.push_back(allowed);
+  return nodes;
+}
+
+// Total cpus we may use, over all nodes
+inline int cpuCount(const std::vector<std::vector<int>>& nodes) {
+  size_t count = 0;
+  for (const std::vector<int>& cpus : nodes)
+    count += cpus.size();
+  return count > 0 ? static_cast<int>(count) : 1;
+}
+
+// Slots go round robin over the nodes, skipping a node once all its cpus
+// have a worker, so a few workers are spread over every socket and a full
+// set lands in proportion to each node's cpus. Past that it wraps around.
+inline int nodeOfSlot(const std::vector<std::vector<int>>& nodes, int slot) {
+  int k = slot % cpuCount(nodes);
+  for (size_t round = 0;; round++)
+    for (size_t n = 0; n < nodes.size(); n++)
+      if (round < nodes[n].size() && k-- == 0)
+        return static_cast<int>(n);
+}
+
+inline void pinToNode(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int c : cpus)
+    if (c < CPU_SETSIZE)
+      CPU_SET(c, &set);
+  // Failing to pin is not fatal, we just lose the locality
+  if (sched_setaffinity(0, sizeof(set), &set) != 0)
+    perror("jacshard: sched_setaffinity");
+}
+
+/*
+The shared segment is only the work table:
+  [ShardHeader][chunk states: nchunks ints]
+The jacobian itself is a DenseJac. Its columns should be leadingDim(M) apart:
+the buffer starts on a page, and with ld a multiple of page/(kChunkCols*8) a
+chunk is a whole number of pages, so no page is written by workers on two
+different nodes.
+*/
+struct ShardHeader {
+  std::atomic<int> cursor;  // next never-claimed chunk
+  int nchunks;
+};
+
+struct ShardTable {
+  void* base = nullptr;
+  size_t bytes = 0;
+  ShardHeader* header = nullptr;
+  std::atomic<int>* chunks = nullptr;
+};
+
+inline int leadingDim(int M) {
+  const size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const size_t align = std::max<size_t>(1, page / (kChunkCols * sizeof(double)));
+  return static_cast<int>((M + align - 1) / align * align);
+}
+
+// Map the table shared and anonymous, so it survives fork and leaves nothing
+// behind if we crash
+inline bool openShardTable(int N, ShardTable& out) {
+  static_assert(ATOMIC_INT_LOCK_FREE == 2,
+                "shared chunk table needs lock free atomics");
+  const int nchunks = (N + kChunkCols - 1) / kChunkCols;
+  const size_t bytes = sizeof(ShardHeader) + nchunks * sizeof(std::atomic<int>);
+  void* base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    perror("jacshard: mmap");
+    return false;
+  }
+
+  out.base = base;
+  out.bytes = bytes;
+  out.header = new (base) ShardHeader;
+  out.header->cursor.store(0);
+  out.header->nchunks = nchunks;
+  out.chunks = reinterpret_cast<std::atomic<int>*>(
+      static_cast<char*>(base) + sizeof(ShardHeader));
+  for (int c = 0; c < nchunks; c++)
+    new (&out.chunks[c]) std::atomic<int>(kChunkFree);
+  return true;
+}
+
+inline void closeShardTable(ShardTable& table) {
+  if (table.base)
+    munmap(table.base, table.bytes);
+  table = ShardTable();
+}
+
+// Grab a chunk: first the ones nobody has touched, then sweep the table for
+// anything a dead worker left behind. Returns -1 when there is nothing left.
+inline int claimChunk(ShardTable& table, int slot) {
+  ShardHeader& h = *table.header;
+  for (int c = h.cursor.fetch_add(1); c < h.nchunks; c = h.cursor.fetch_add(1)) {
+    int expected = kChunkFree;
+    if (table.chunks[c].compare_exchange_strong(expected, slot + 1))
+      return c;
+  }
+  for (int c = 0; c < h.nchunks; c++) {
+    int expected = kChunkFree;
+    if (table.chunks[c].compare_exchange_strong(expected, slot + 1))
+      return c;
+  }
+  return -1;
+}
+
+// Body of a worker process; same function and checks as runJacTest2
+inline int runWorker(ShardTable& table,
+                     adoopp::DenseJac& jac,
+                     int slot,
+                     const double* points) {
+  const int N = jac.cols();
+  const int M = jac.rows();
+  // Allocated once per worker; only the seed moves from column to column.
+  // fij reads x_j too, so we need max(N, M) variables
+  const int K = std::max(N, M);
+  std::vector<adoopp::Dual> vars(K);
+  for (int i = 0; i < K; i++)
+    vars[i] = adoopp::Dual(points[i], 0);
+
+  int errors = 0;
+  for (int c = claimChunk(table, slot); c >= 0; c = claimChunk(table, slot)) {
+    const int first = c * kChunkCols;
+    const int last = first + kChunkCols < N ? first + kChunkCols : N;
+    for (int wrt = first; wrt < last; wrt++) {
+      vars[wrt].setDual(1);
+      double* col = jac.column(wrt);
+      for (int j = 0; j < M; j++) {
+        // The function of interest is just fij = x_{i}^2*x_j
+        adoopp::Dual func = vars[wrt] * vars[wrt] * vars[j];
+        col[j] = func.dual();
+        double check = 2 * vars[wrt].real() * vars[j].real();
+        if (j == wrt)
+          check += vars[wrt].real() * vars[wrt].real();
+        if (func.dual() != check) {
+          printf("Jacobian Shard Error: derivative wrong at: %d %d\n", j, wrt);
+          errors++;
+        }
+      }
+      vars[wrt].setDual(0);
+    }
+    // Mark done only once the whole chunk is written; if we die before this
+    // the coordinator hands the chunk to someone else, which is harmless
+    table.chunks[c].store(kChunkDone);
+  }
+  return errors == 0 ? 0 : 1;
+}
+
+inline pid_t spawnWorker(ShardTable& table,
+                         adoopp::DenseJac& jac,
+                         int slot,
+                         const double* points,
+                         const std::vector<std::vector<int>>& nodes) {
+  // Don't let the children inherit (and flush twice) our stdio buffers
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (nodes.size() > 1)
+      pinToNode(nodes[nodeOfSlot(nodes, slot)]);
+    int rc = runWorker(table, jac, slot, points);
+    fflush(stdout);
+    _exit(rc);
+  }
+  if (pid < 0)
+    perror("jacshard: fork");
+  return pid;
+}
+
+// Put everything a crashed slot had claimed back in the pool
+inline void releaseChunks(ShardTable& table, int slot) {
+  for (int c = 0; c < table.header->nchunks; c++) {
+    int expected = slot + 1;
+    table.chunks[c].compare_exchange_strong(expected, kChunkFree);
+  }
+}
+
+}  // namespace jacshard
+
+/*
+Same jacobian as runJacTest2, fij = x_{i}^2*x_j, split across nprocs worker
+processes and kept in jac. nprocs <= 0 means one worker per cpu.
+
+jac has to be shareable (JacBuffer::shared or file backed) or the workers'
+columns never reach us; give it ld = jacshard::leadingDim(rows) to keep
+chunks on their own pages.
+*/
+void runJacTest2Sharded(adoopp::DenseJac& jac, int nprocs) {
+  const int N = jac.cols();
+  const int M = jac.rows();
+  if (!jac.shareable()) {
+    printf("Jacobian Shard Test aborted: jacobian is not in shared memory\n");
+    return;
+  }
+  std::vector<std::vector<int>> nodes = jacshard::numaNodes();
+  if (nprocs <= 0)
+    nprocs = jacshard::cpuCount(nodes);
+
+  std::vector<double> points(std::max(N, M));
+  // x_i = i+1, same points as runJacTest2
+  for (size_t i = 0; i < points.size(); i++)
+    points[i] = i + 1;
+
+  jacshard::ShardTable table;
+  if (!jacshard::openShardTable(N, table)) {
+    printf("Jacobian Shard Test aborted: no shared memory\n");
+    return;
+  }
+
+  std::vector<pid_t> pids(nprocs, -1);
+  std::vector<int> restarts(nprocs, 0);
+  int running = 0;
+  for (int s = 0; s < nprocs; s++) {
+    pids[s] = jacshard::spawnWorker(table, jac, s, points.data(), nodes);
+    if (pids[s] > 0)
+      running++;
+  }
+
+  // Coordinator: wait on workers, restart the ones that crash
+  bool failed = false;
+  while (running > 0) {
+    int status = 0;
+    pid_t pid = waitpid(-1, &status, 0);
+    if (pid < 0) {
+      // EINTR just means a signal cut the wait short, the workers are still
+      // running. Anything else and we can't track them any more: stop them
+      // so nobody writes into the matrix after we unmap it.
+      if (errno == EINTR)
+        continue;
+      perror("jacshard: waitpid");
+      for (pid_t p : pids)
+        if (p > 0)
+          kill(p, SIGKILL);
+      failed = true;
+      break;
+    }
+    int slot = -1;
+    for (int s = 0; s < nprocs; s++)
+      if (pids[s] == pid)
+        slot = s;
+    if (slot < 0)
+      continue;
+    running--;
+    pids[slot] = -1;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+      continue;
+    if (WIFEXITED(status)) {
+      // The worker ran to completion but found wrong derivatives;
+      // restarting won't change the math
+      failed = true;
+      continue;
+    }
+    printf("Jacobian Shard worker %d died (signal %d), restarting\n", slot,
+           WTERMSIG(status));
+    jacshard::releaseChunks(table, slot);
+    if (++restarts[slot] > jacshard::kMaxRestarts) {
+      failed = true;
+      continue;
+    }
+    pids[slot] = jacshard::spawnWorker(table, jac, slot, points.data(), nodes);
+    if (pids[slot] > 0)
+      running++;
+  }
+
+  // Every chunk should be done; if all workers gave up some won't be
+  for (int c = 0; c < table.header->nchunks; c++)
+    if (table.chunks[c].load() != jacshard::kChunkDone) {
+      printf("Jacobian Shard Error: columns %d.. never computed\n",
+             c * jacshard::kChunkCols);
+      failed = true;
+    }
+
+  for (int j = 0; j < M; j++)
+    for (int wrt = 0; wrt < N; wrt++)
+      if (N <= 10 || (((j + 1) % 100 == 0) && ((wrt + 1) % 100 == 0)))
+        printf("Jac(%d, %d): %0.0f\t\n", j + 1, wrt + 1, jac(j, wrt));
+
+  jacshard::closeShardTable(table);
+  jac.flush();
+  if (failed)
+    printf("Jacobian Shard Test failed with size: %d %d \n", N, M);
+  else
+    printf("Jacobian Shard Test Completed with size: %d %d on %d procs\n", N, M,
+           nprocs);
+}
+
+void runJacTest2Sharded(int N, int M, int nprocs) {
+  const int ld = jacshard::leadingDim(M);
+  adoopp::DenseJac jac(M, N, adoopp::JacBuffer::shared(static_cast<size_t>(ld) * N),
+                       ld);
+  runJacTest2Sharded(jac, nprocs);
+}
+
+void runJacTest2Sharded(int N, int nprocs) {
+  runJacTest2Sharded(N, N, nprocs);
+}
+
+#endif
@@ -1,10 +1,12 @@
 #ifndef INCLUDED_JACTEST
 #define INCLUDED_JACTEST
 #include <omp.h>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <vector>
 #include "dual.hpp"
+#include "jacmatrix.hpp"
 
 /*
 This function is to test that the jacobian for a scalar function is computed
@@ -167,6 +169,54 @@ void runJacTest2(int N, int M) {
   printf("Jacobian Test 2 Completed with size: %d %d \n", N, M);
 }
 
+/*
+Same jacobian as runJacTest2, but kept: the container fills itself in place in
+whatever order suits its layout (see jacmatrix.hpp), so this works for the
+dense, blocked and CSR containers, heap or file backed.
+
+Like runJacTest2 we seed one variable and get a whole column out of it, fij =
+x_{i}^2*x_j for every j. The variables are set up once; fillColumns hands each
+thread its own copy, and only the seed moves from column to column.
+*/
+template <typename Jac>
+void runJacTest2InPlace(Jac& jac) {
+  const int M = jac.rows();
+  const int N = jac.cols();
+  // fij reads x_j too, so we need max(N, M) variables
+  std::vector<adoopp::Dual> vars(std::max(N, M));
+  // i+1 to avoid awkwardness of 0, as above
+  for (size_t i = 0; i < vars.size(); i++)
+    vars[i] = adoopp::Dual(i + 1, 0);
+  int errors = 0;
+  int* errs = &errors;
+  jac.fillColumns([vars, errs, M](int wrt, double* col) mutable {
+    vars[wrt].setDual(1);
+    for (int j = 0; j < M; j++) {
+      adoopp::Dual func = vars[wrt] * vars[wrt] * vars[j];
+      col[j] = func.dual();
+      double check = 2 * vars[wrt].real() * vars[j].real();
+      if (j == wrt)
+        check += vars[wrt].real() * vars[wrt].real();
+      if (func.dual() != check) {
+#pragma omp atomic
+        (*errs)++;
+        printf("Jacobian Test 2 Error: derivative wrong at: %d %d\n", j, wrt);
+      }
+    }
+    vars[wrt].setDual(0);
+  });
+  jac.flush();
+  for (int i = 0; i < M; i++)
+    for (int j = 0; j < N; j++)
+      if (N <= 10 || (((i + 1) % 100 == 0) && ((j + 1) % 100 == 0)))
+        printf("Jac(%d, %d): %0.0f\t\n", i + 1, j + 1, jac(i, j));
+  if (errors == 0)
+    printf("Jacobian Test 2 Completed in place with size: %d %d \n", N, M);
+  else
+    printf("Jacobian Test 2 failed in place with %d errors, size: %d %d \n",
+           errors, N, M);
+}
+
 // If we want a square matrix, just assign both entries the same
 // This is likely what I will actually use in the project
 void runJacTest2(int N) {